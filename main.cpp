@@ -5,6 +5,18 @@
 #include <unordered_map>
 #include <iomanip>
 #include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <charconv>
+#include <cstdio>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 using namespace std;
 
@@ -15,13 +27,37 @@ const int memory_size = 400000;
 
 // Register and Memory Arrays
 int64_t registers[no_of_registers];       // Register array
-int memory[memory_size];           // Memory array for simulation
+uint8_t mainMemory[memory_size];   // Memory array for simulation (one byte per cell)
+uint8_t *memory = mainMemory;      // Active memory (swapped during co-simulation)
 
 // Program Counter
 int PC = 0;                         // Program Counter (PC)
 vector<string> instructions;        // Stores the loaded instructions
+vector<int> instructionLines;       // Source line of each instruction
 vector<int> breakpoints;
 
+// Write watchpoints (set through the gdb stub)
+struct Watchpoint {
+    int address;
+    int length;
+};
+
+vector<Watchpoint> watchpoints;
+int watchpointHit = -1;             // Address of the last store that hit a watchpoint
+
+// Performance counters. instret/cycles are advanced by retireInstruction(),
+// the rest by the individual instructions. The model is single-cycle, so
+// cycles == instret.
+struct Counters {
+    uint64_t cycles;
+    uint64_t instret;
+    uint64_t loads;
+    uint64_t stores;
+    uint64_t branchesTaken;
+};
+
+Counters counters;
+
 // Register Name Map
 unordered_map<string, int> regNameMap = {
     {"x0", 0}, {"x1", 1}, {"x2", 2}, {"x3", 3}, {"x4", 4}, {"x5", 5},
@@ -40,19 +76,121 @@ struct Label {
 };
 
 vector<Label> labelList;
+int dataSectionEnd = DATA_SECTION_START;   // One past the last byte written by data directives
 
 void reset() {
     fill(begin(registers), end(registers), 0);
-    fill(begin(memory), end(memory), 0);
+    memset(memory, 0, memory_size);
+    counters = Counters();
     PC = 0;
 }
 
-void MapLabels(ifstream &inputFile, vector<Label> &labelList) {
+// Pages stored to since the last co-simulation check (empty when not co-simulating)
+const int dirtyPageSize = 256;
+vector<uint8_t> dirtyPages;
+
+void markDirty(int address, int count) {
+    if (dirtyPages.empty() || count <= 0) {
+        return;
+    }
+    for (int page = address / dirtyPageSize; page <= (address + count - 1) / dirtyPageSize; ++page) {
+        dirtyPages[page] = 1;
+    }
+}
+
+// Called after every guest store to check it against the watchpoints
+void noteStore(int address, int width) {
+    counters.stores++;
+    markDirty(address, width);
+    for (const auto &wp : watchpoints) {
+        if (address < wp.address + wp.length && wp.address < address + width) {
+            watchpointHit = address;
+            return;
+        }
+    }
+}
+
+// Bulk memory primitives. Both are bounds-checked against the memory array
+// and return false (leaving memory untouched) if the range does not fit.
+bool inMemoryBounds(int addr, int count) {
+    return addr >= 0 && count >= 0 && addr <= memory_size - count;
+}
+
+bool memoryFill(int addr, uint8_t value, int count) {
+    if (!inMemoryBounds(addr, count)) {
+        return false;
+    }
+    memset(memory + addr, value, count);
+    return true;
+}
+
+bool memoryCopy(int dst, int src, int count) {
+    if (!inMemoryBounds(dst, count) || !inMemoryBounds(src, count)) {
+        return false;
+    }
+    memmove(memory + dst, memory + src, count);
+    return true;
+}
+
+// Parses a data directive operand (decimal or 0x-prefixed hex, optional sign
+// and trailing comma) without going through stoi.
+bool parseDataValue(const string &text, int64_t &value) {
+    const char *first = text.data();
+    const char *last = first + text.size();
+    if (first != last && *(last - 1) == ',') {
+        --last;
+    }
+    bool negative = false;
+    if (first != last && (*first == '-' || *first == '+')) {
+        negative = (*first == '-');
+        ++first;
+    }
+    int base = 10;
+    if (last - first > 2 && first[0] == '0' && (first[1] == 'x' || first[1] == 'X')) {
+        base = 16;
+        first += 2;
+    }
+    uint64_t magnitude = 0;
+    auto result = from_chars(first, last, magnitude, base);
+    if (result.ec != errc() || result.ptr != last) {
+        return false;
+    }
+    value = negative ? (int64_t)(0 - magnitude) : (int64_t)magnitude;
+    return true;
+}
+
+// Writes every operand of a .dword/.word/.half/.byte line as a little-endian
+// value of the given width, advancing address past the stored bytes.
+void storeDataDirective(stringstream &ss, int width, int &address) {
+    string value;
+    while (ss >> value) {
+        int64_t value_int;
+        if (!parseDataValue(value, value_int)) {
+            cerr << "Error: Invalid data value '" << value << "'.\n";
+            exit(1);
+        }
+        if (!inMemoryBounds(address, width)) {
+            cerr << "Error: Data section exceeds memory size.\n";
+            exit(1);
+        }
+        uint8_t bytes[8];
+        for (int i = 0; i < 8; ++i) {
+            bytes[i] = (value_int >> (8 * i)) & 0xFF;
+        }
+        memcpy(memory + address, bytes, width);
+        address += width;
+    }
+}
+
+void MapLabels(istream &inputFile, vector<Label> &labelList) {
     string line;
     int instructionIndex = 0;
     int address = DATA_SECTION_START;
 
+    int lineNumber = 0;
+
     while (getline(inputFile, line)) {
+        lineNumber++;
         if (line.find(".data") != string::npos) {
             continue;
         }
@@ -89,74 +227,28 @@ void MapLabels(ifstream &inputFile, vector<Label> &labelList) {
 
         
         if (word == ".dword") {
-            string value;
-            while (ss >> value) {
-                if(*(value.end()-1) == ',')
-                {
-                    value = value.substr(0,value.length()-1);
-                }
-                int value_int = stoi(value);
-                for (int i = 0; i < 8; ++i) {
-                    memory[address + i] = value_int & 0xFF;
-                    value_int >>= 8;
-                }
-                address += 8;  // Move to the next 8-byte block
-            }
+            storeDataDirective(ss, 8, address);
         }
         if (word == ".word") {
-            string value;
-            while (ss >> value) {
-                if(*(value.end()-1) == ',')
-                {
-                    value = value.substr(0,value.length()-1);
-                }
-                int value_int = stoi(value);
-                for (int i = 0; i < 4; ++i) {
-                    memory[address + i] = value_int & 0xFF;
-                    value_int >>= 8;
-                }
-                address += 4;  // Move to the next 8-byte block
-            }
+            storeDataDirective(ss, 4, address);
         }
         if (word == ".half") {
-            string value;
-            while (ss >> value) {
-                if(*(value.end()-1) == ',')
-                {
-                    value = value.substr(0,value.length()-1);
-                }
-                int value_int = stoi(value);
-                for (int i = 0; i < 2; ++i) {
-                    memory[address + i] = value_int & 0xFF;
-                    value_int >>= 8;
-                }
-                address += 2;  // Move to the next 8-byte block
-            }
+            storeDataDirective(ss, 2, address);
         }
         if (word == ".byte") {
-            string value;
-            while (ss >> value) {
-                if(*(value.end()-1) == ',')
-                {
-                    value = value.substr(0,value.length()-1);
-                }
-                int value_int = stoi(value);
-                for (int i = 0; i < 1; ++i) {
-                    memory[address + i] = value_int & 0xFF;
-                    value_int >>= 8;
-                }
-                address += 1;  // Move to the next 8-byte block
-            }
+            storeDataDirective(ss, 1, address);
         }
         if (!word.empty()) {
             if( word == ".dword" || word == ".word" || word == ".half" || word == ".byte" ){
                 continue;
             }
             instructions.push_back(line);
+            instructionLines.push_back(lineNumber);
             instructionIndex++;
         }
     }
 
+    dataSectionEnd = address;
     inputFile.clear();
     inputFile.seekg(0, ios::beg);
 }
@@ -169,19 +261,627 @@ Label FindLabel(const vector<Label> &labelList, const string &label) {
     }
 }
 
+// ---------------------------------------------------------------------------
+// Decode cache and RVC support
+//
+// Instructions are laid out at byte addresses: c.* (RVC) instructions take 2
+// bytes, everything else 4. Each compressed instruction is expanded once to
+// its base-ISA equivalent, and a table indexed by PC / 2 maps a PC back to
+// its instruction. Branch and jump immediates still count instructions, as
+// they always have in this simulator.
+// ---------------------------------------------------------------------------
+
+struct DecodedInstruction {
+    string text;                    // Base-ISA form run by executeInstruction
+    int address;                    // Byte address
+    int length;                     // 2 for compressed, 4 otherwise
+};
+
+vector<DecodedInstruction> decoded; // One per entry in instructions
+vector<int> decodeCache;            // PC / 2 -> index into decoded, -1 if no instruction starts there
+int textSize = 0;                   // Code size in bytes
+int compressedCount = 0;
+int currentInstructionLength = 4;   // Length of the instruction being executed
+
+// Splits "op a, off(b)" into {"op", "a", "off", "b"}
+vector<string> splitOperands(const string &instruction) {
+    string text = instruction;
+    replace_if(text.begin(), text.end(), [](char c) { return c == ',' || c == '(' || c == ')'; }, ' ');
+    stringstream ss(text);
+    vector<string> tokens;
+    string token;
+    while (ss >> token) {
+        tokens.push_back(token);
+    }
+    return tokens;
+}
+
+// Instruction index at pc, or -1 if no instruction starts there
+int fetchIndex(int pc) {
+    if (pc < 0 || pc % 2 != 0 || pc / 2 >= (int)decodeCache.size()) {
+        return -1;
+    }
+    return decodeCache[pc / 2];
+}
+
+bool pcInProgram(int pc) {
+    return fetchIndex(pc) >= 0;
+}
+
+// Byte address of an instruction index; one past the last is the end of text
+int instructionAddressOf(int index) {
+    if (index >= 0 && index < (int)decoded.size()) {
+        return decoded[index].address;
+    }
+    if (index == (int)decoded.size()) {
+        return textSize;
+    }
+    return -1;
+}
+
+// Target of a branch whose immediate is an offset in instructions
+int relativeTarget(int offset) {
+    int target = instructionAddressOf(fetchIndex(PC) + offset);
+    return target >= 0 ? target : PC + offset * 4;
+}
+
+// Plain decimal immediate, the only form executeInstruction's stoi reads
+// fully (it would stop at the 'x' of a hex literal)
+bool parseDecimalImmediate(const string &text, int64_t &value) {
+    size_t digits = (!text.empty() && (text[0] == '-' || text[0] == '+')) ? 1 : 0;
+    if (digits == text.size() || !all_of(text.begin() + digits, text.end(), ::isdigit)) {
+        return false;
+    }
+    return parseDataValue(text, value) && value >= INT32_MIN && value <= INT32_MAX;
+}
+
+// Expands one RVC instruction to the equivalent base instruction. Registers
+// and immediates are checked against what the 16-bit encodings can hold:
+// 3-bit register fields (c.lw, c.sub, c.beqz, ...) must be x8-x15, and
+// immediates must fit their field and scaling. Branch ranges are checked
+// later, once addresses are known.
+bool expandCompressed(const string &instruction, string &expanded, string &error) {
+    vector<string> ops = splitOperands(instruction);
+    const string &op = ops[0];
+    auto regNumber = [&](size_t i) {
+        return (i < ops.size() && regNameMap.count(ops[i])) ? regNameMap[ops[i]] : -1;
+    };
+    auto reg = [&](size_t i, bool compact) {
+        int n = regNumber(i);
+        if (n < 0) {
+            error = "bad register operand";
+            return false;
+        }
+        if (compact && (n < 8 || n > 15)) {
+            error = "register " + ops[i] + " is not one of x8-x15";
+            return false;
+        }
+        return true;
+    };
+    auto nonZeroReg = [&](size_t i, bool compact) {
+        if (!reg(i, compact)) return false;
+        if (regNumber(i) == 0) {
+            error = "register operand " + to_string(i) + " cannot be x0";
+            return false;
+        }
+        return true;
+    };
+    // Immediate at operand i in [low, high] and a multiple of scale
+    auto imm = [&](size_t i, int64_t low, int64_t high, int64_t scale, bool nonZero) {
+        int64_t value;
+        if (i >= ops.size() || !parseDecimalImmediate(ops[i], value)) {
+            error = "immediate must be a decimal number";
+            return false;
+        }
+        if (value < low || value > high || value % scale != 0 || (nonZero && value == 0)) {
+            error = "immediate " + ops[i] + " must be" +
+                    (scale > 1 ? " a multiple of " + to_string(scale) : string()) + " in [" + to_string(low) +
+                    ", " + to_string(high) + "]" + (nonZero ? " and non-zero" : "");
+            return false;
+        }
+        return true;
+    };
+    auto arity = [&](size_t n) {
+        if (ops.size() != n + 1) {
+            error = "expected " + to_string(n) + " operands";
+            return false;
+        }
+        return true;
+    };
+    auto isSp = [&](size_t i) {
+        if (regNumber(i) != 2) {
+            error = "register operand must be sp";
+            return false;
+        }
+        return true;
+    };
+
+    if (op == "c.nop") {
+        if (!arity(0)) return false;
+        expanded = "addi x0, x0, 0";
+    } else if (op == "c.addi") {
+        if (!arity(2) || !nonZeroReg(1, false) || !imm(2, -32, 31, 1, true)) return false;
+        expanded = "addi " + ops[1] + ", " + ops[1] + ", " + ops[2];
+    } else if (op == "c.slli") {
+        if (!arity(2) || !nonZeroReg(1, false) || !imm(2, 1, 63, 1, true)) return false;
+        expanded = "slli " + ops[1] + ", " + ops[1] + ", " + ops[2];
+    } else if (op == "c.srli" || op == "c.srai") {
+        if (!arity(2) || !reg(1, true) || !imm(2, 1, 63, 1, true)) return false;
+        expanded = op.substr(2) + " " + ops[1] + ", " + ops[1] + ", " + ops[2];
+    } else if (op == "c.andi") {
+        if (!arity(2) || !reg(1, true) || !imm(2, -32, 31, 1, false)) return false;
+        expanded = "andi " + ops[1] + ", " + ops[1] + ", " + ops[2];
+    } else if (op == "c.li") {
+        if (!arity(2) || !nonZeroReg(1, false) || !imm(2, -32, 31, 1, false)) return false;
+        expanded = "addi " + ops[1] + ", x0, " + ops[2];
+    } else if (op == "c.lui") {
+        // lui reads its operand with stoi base 0, so hex is fine here
+        if (!arity(2) || !nonZeroReg(1, false)) return false;
+        if (regNumber(1) == 2) {
+            error = "c.lui cannot target sp";
+            return false;
+        }
+        char *end = nullptr;
+        long long value = strtoll(ops[2].c_str(), &end, 0);
+        bool fits = (value >= 1 && value <= 31) || (value >= -32 && value <= -1) ||
+                    (value >= 0xFFFE0 && value <= 0xFFFFF);
+        if (*end != '\0' || !fits) {
+            error = "immediate " + ops[2] + " must be a non-zero 6-bit signed value (or 0xfffe0-0xfffff)";
+            return false;
+        }
+        expanded = "lui " + ops[1] + ", " + ops[2];
+    } else if (op == "c.addi16sp") {
+        if (ops.size() < 2 || ops.size() > 3 || (ops.size() == 3 && !isSp(1))) {
+            error = error.empty() ? "expected [sp,] imm" : error;
+            return false;
+        }
+        if (!imm(ops.size() - 1, -512, 496, 16, true)) return false;
+        expanded = "addi sp, sp, " + ops.back();
+    } else if (op == "c.addi4spn") {
+        if (!arity(3) || !reg(1, true) || !isSp(2) || !imm(3, 4, 1020, 4, true)) return false;
+        expanded = "addi " + ops[1] + ", sp, " + ops[3];
+    } else if (op == "c.mv" || op == "c.add") {
+        if (!arity(2) || !nonZeroReg(1, false) || !nonZeroReg(2, false)) return false;
+        expanded = "add " + ops[1] + ", " + (op == "c.mv" ? string("x0") : ops[1]) + ", " + ops[2];
+    } else if (op == "c.sub" || op == "c.xor" || op == "c.or" || op == "c.and") {
+        if (!arity(2) || !reg(1, true) || !reg(2, true)) return false;
+        expanded = op.substr(2) + " " + ops[1] + ", " + ops[1] + ", " + ops[2];
+    } else if (op == "c.lw" || op == "c.sw" || op == "c.ld" || op == "c.sd") {
+        int scale = (op[3] == 'w') ? 4 : 8;
+        if (!arity(3) || !reg(1, true) || !imm(2, 0, 31 * scale, scale, false) || !reg(3, true)) return false;
+        expanded = op.substr(2) + " " + ops[1] + ", " + ops[2] + "(" + ops[3] + ")";
+    } else if (op == "c.lwsp" || op == "c.ldsp" || op == "c.swsp" || op == "c.sdsp") {
+        int scale = (op[3] == 'w') ? 4 : 8;
+        bool isLoad = (op[2] == 'l');
+        if (!arity(3) || !(isLoad ? nonZeroReg(1, false) : reg(1, false)) ||
+            !imm(2, 0, 63 * scale, scale, false) || !isSp(3)) {
+            return false;
+        }
+        expanded = op.substr(2, 2) + " " + ops[1] + ", " + ops[2] + "(sp)";
+    } else if (op == "c.j") {
+        if (!arity(1)) return false;
+        expanded = "jal x0, " + ops[1];
+    } else if (op == "c.jr" || op == "c.jalr") {
+        if (!arity(1) || !nonZeroReg(1, false)) return false;
+        expanded = string(op == "c.jr" ? "jalr x0, " : "jalr x1, ") + ops[1] + "(0)";
+    } else if (op == "c.beqz" || op == "c.bnez") {
+        if (!arity(2) || !reg(1, true)) return false;
+        expanded = string(op == "c.beqz" ? "beq " : "bne ") + ops[1] + ", x0, " + ops[2];
+    } else {
+        error = "unsupported compressed instruction";
+        return false;
+    }
+    return true;
+}
+
+// Checks that a c.j/c.beqz/c.bnez target is within the encodable byte offset
+bool checkCompressedBranch(size_t index, string &error) {
+    vector<string> ops = splitOperands(instructions[index]);
+    if (ops[0] != "c.j" && ops[0] != "c.beqz" && ops[0] != "c.bnez") {
+        return true;
+    }
+    int targetIndex = -1;
+    for (const auto &lbl : labelList) {
+        if (lbl.name == ops.back()) {
+            targetIndex = lbl.address;
+            break;
+        }
+    }
+    int64_t offset;
+    if (targetIndex < 0) {
+        if (!parseDecimalImmediate(ops.back(), offset)) {
+            error = "unknown branch target " + ops.back();
+            return false;
+        }
+        targetIndex = (int)index + (int)offset;
+    }
+    int target = instructionAddressOf(targetIndex);
+    if (target < 0) {
+        error = "branch target is outside the program";
+        return false;
+    }
+    int64_t distance = (int64_t)target - decoded[index].address;
+    int64_t limit = (ops[0] == "c.j") ? 2048 : 256;
+    if (distance < -limit || distance >= limit) {
+        error = "branch target is out of range for " + ops[0];
+        return false;
+    }
+    return true;
+}
+
+void buildDecodeCache() {
+    decoded.clear();
+    compressedCount = 0;
+    int address = 0;
+    for (size_t i = 0; i < instructions.size(); ++i) {
+        DecodedInstruction insn = {instructions[i], address, 4};
+        stringstream ss(instructions[i]);
+        string opcode;
+        ss >> opcode;
+        if (opcode.compare(0, 2, "c.") == 0) {
+            string error;
+            if (!expandCompressed(instructions[i], insn.text, error)) {
+                cerr << "Error: Line " << instructionLines[i] << ": " << error << ": " << instructions[i] << "\n";
+                exit(1);
+            }
+            insn.length = 2;
+            compressedCount++;
+        }
+        decoded.push_back(insn);
+        address += insn.length;
+    }
+    textSize = address;
+    decodeCache.assign(textSize / 2, -1);
+    for (size_t i = 0; i < decoded.size(); ++i) {
+        decodeCache[decoded[i].address / 2] = i;
+    }
+    for (size_t i = 0; i < decoded.size(); ++i) {
+        string error;
+        if (decoded[i].length == 2 && !checkCompressedBranch(i, error)) {
+            cerr << "Error: Line " << instructionLines[i] << ": " << error << ": " << instructions[i] << "\n";
+            exit(1);
+        }
+    }
+}
+
+// A guest copy/fill loop recognised at load time. The body is straight-line:
+// an optional load, one store of the same width, then addi increments, closed
+// by a bne back to the head, e.g.
+//     loop: lb t0, 0(a1)
+//           sb t0, 0(a0)
+//           addi a1, a1, 1
+//           addi a0, a0, 1
+//           bne a1, a2, loop
+// Without the load, the store writes an invariant register (a fill).
+struct CopyLoop {
+    int head;                   // Instruction index of the loop head
+    int length;                 // Body length including the closing bne
+    int width;                  // Bytes per load/store
+    bool isCopy;                // Load + store (memmove) or store only (fill)
+    int loadRd, loadBase, loadOffset;
+    int storeSrc, storeBase, storeOffset;
+    int counter, bound;         // bne operands: incremented and invariant
+    vector<pair<int, int64_t>> increments;  // Register and per-iteration step
+};
+
+unordered_map<int, CopyLoop> copyLoops;    // Keyed by head instruction index
+
+bool parseLoopRegister(const string &name, int &reg) {
+    auto it = regNameMap.find(name);
+    if (it == regNameMap.end()) {
+        return false;
+    }
+    reg = it->second;
+    return true;
+}
+
+int loadWidth(const string &opcode) {
+    if (opcode == "lb" || opcode == "lbu") return 1;
+    if (opcode == "lh") return 2;
+    if (opcode == "lw" || opcode == "lwu") return 4;
+    if (opcode == "ld") return 8;
+    return 0;
+}
+
+int storeWidth(const string &opcode) {
+    if (opcode == "sb") return 1;
+    if (opcode == "sh") return 2;
+    if (opcode == "sw") return 4;
+    if (opcode == "sd") return 8;
+    return 0;
+}
+
+// Tries to match the loop closed by the bne at instruction index branchIndex
+bool matchCopyLoop(int branchIndex, CopyLoop &loop) {
+    vector<string> bne = splitOperands(decoded[branchIndex].text);
+    if (bne.size() != 4 || bne[0] != "bne") {
+        return false;
+    }
+    int head = -1;
+    for (const auto &lbl : labelList) {
+        if (lbl.name == bne[3]) {
+            head = lbl.address;
+            break;
+        }
+    }
+    int64_t offset;
+    if (head < 0 && parseDecimalImmediate(bne[3], offset)) {
+        head = branchIndex + (int)offset;
+    }
+    if (head < 0 || head >= branchIndex) {
+        return false;
+    }
+
+    loop = CopyLoop();
+    loop.head = head;
+    loop.length = branchIndex - head + 1;
+    loop.loadRd = -1;
+    int i = head;
+    vector<string> ops = splitOperands(decoded[i].text);
+    if (ops.size() == 4 && loadWidth(ops[0]) != 0) {
+        int64_t off;
+        if (!parseLoopRegister(ops[1], loop.loadRd) || !parseDecimalImmediate(ops[2], off) ||
+            !parseLoopRegister(ops[3], loop.loadBase)) {
+            return false;
+        }
+        loop.loadOffset = (int)off;
+        loop.width = loadWidth(ops[0]);
+        loop.isCopy = true;
+        ops = splitOperands(decoded[++i].text);
+    }
+    if (i >= branchIndex || ops.size() != 4 || storeWidth(ops[0]) == 0) {
+        return false;
+    }
+    int64_t off;
+    if (!parseLoopRegister(ops[1], loop.storeSrc) || !parseDecimalImmediate(ops[2], off) ||
+        !parseLoopRegister(ops[3], loop.storeBase)) {
+        return false;
+    }
+    loop.storeOffset = (int)off;
+    if (loop.isCopy && (storeWidth(ops[0]) != loop.width || loop.storeSrc != loop.loadRd)) {
+        return false;
+    }
+    loop.width = storeWidth(ops[0]);
+
+    for (++i; i < branchIndex; ++i) {
+        ops = splitOperands(decoded[i].text);
+        int rd, rs1;
+        int64_t step;
+        if (ops.size() != 4 || ops[0] != "addi" || !parseLoopRegister(ops[1], rd) ||
+            !parseLoopRegister(ops[2], rs1) || rd != rs1 || rd == 0 || !parseDecimalImmediate(ops[3], step)) {
+            return false;
+        }
+        for (const auto &inc : loop.increments) {
+            if (inc.first == rd) {
+                return false;
+            }
+        }
+        loop.increments.push_back({rd, step});
+    }
+
+    auto stepOf = [&](int reg) -> int64_t {
+        for (const auto &inc : loop.increments) {
+            if (inc.first == reg) {
+                return inc.second;
+            }
+        }
+        return 0;
+    };
+    int rs1, rs2;
+    if (!parseLoopRegister(bne[1], rs1) || !parseLoopRegister(bne[2], rs2)) {
+        return false;
+    }
+    if ((stepOf(rs1) != 0) == (stepOf(rs2) != 0)) {
+        return false;  // Exactly one operand must be the induction register
+    }
+    loop.counter = stepOf(rs1) != 0 ? rs1 : rs2;
+    loop.bound = stepOf(rs1) != 0 ? rs2 : rs1;
+
+    // Pointers advance forward by one element; everything else stays invariant
+    if (stepOf(loop.storeBase) != loop.width) {
+        return false;
+    }
+    if (loop.isCopy) {
+        if (stepOf(loop.loadBase) != loop.width || loop.loadBase == loop.storeBase ||
+            loop.loadRd == 0 || stepOf(loop.loadRd) != 0 || loop.loadRd == loop.loadBase ||
+            loop.loadRd == loop.storeBase || loop.loadRd == loop.bound) {
+            return false;
+        }
+    } else if (stepOf(loop.storeSrc) != 0) {
+        return false;
+    }
+    return true;
+}
+
+void detectCopyLoops() {
+    copyLoops.clear();
+    for (int i = 0; i < (int)instructions.size(); ++i) {
+        CopyLoop loop;
+        if (matchCopyLoop(i, loop)) {
+            copyLoops[loop.head] = loop;
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Program cache
+//
+// With --cache-dir <dir>, every loaded program is also saved as a binary
+// image named after a hash of its source text and the simulator version. A
+// later load of the same source maps the image instead of re-parsing it.
+// Image layout: header, then per instruction (u32 line, u32 length, text), per label
+// (u32 address, u32 length, name), then the initial data section bytes.
+// ---------------------------------------------------------------------------
+
+const char *simulatorVersion = "riscv_asm 1.1";
+string programCacheDir;             // Empty: caching disabled
+
+struct ProgramImageHeader {
+    char magic[8];
+    uint64_t key;
+    uint32_t instructionCount;
+    uint32_t labelCount;
+    uint32_t dataStart;
+    uint32_t dataLength;
+};
+
+const char programImageMagic[8] = {'R', 'V', 'I', 'M', 'G', '0', '2', '\0'};
+
+// FNV-1a over the simulator version followed by the source text
+uint64_t programCacheKey(const string &source) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    auto mix = [&](const char *data, size_t length) {
+        for (size_t i = 0; i < length; ++i) {
+            hash = (hash ^ (uint8_t)data[i]) * 0x100000001b3ULL;
+        }
+    };
+    mix(simulatorVersion, strlen(simulatorVersion) + 1);
+    mix(source.data(), source.size());
+    return hash;
+}
+
+string programCachePath(uint64_t key) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.img", (unsigned long long)key);
+    return programCacheDir + "/" + name;
+}
+
+static void appendU32(string &out, uint32_t value) {
+    out.append((const char *)&value, sizeof(value));
+}
+
+// Restores instructions, labels and data from a cached image. Leaves the
+// program state untouched and returns false if the image is missing or bad.
+bool loadProgramImage(uint64_t key) {
+    int fd = open(programCachePath(key).c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) < 0 || info.st_size < (off_t)sizeof(ProgramImageHeader)) {
+        close(fd);
+        return false;
+    }
+    size_t size = info.st_size;
+    void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+
+    const char *base = (const char *)mapped;
+    const char *end = base + size;
+    ProgramImageHeader header;
+    memcpy(&header, base, sizeof(header));
+    const char *cursor = base + sizeof(header);
+    auto readU32 = [&](uint32_t &value) {
+        if (end - cursor < (ptrdiff_t)sizeof(value)) {
+            return false;
+        }
+        memcpy(&value, cursor, sizeof(value));
+        cursor += sizeof(value);
+        return true;
+    };
+
+    vector<string> cachedInstructions;
+    vector<int> cachedLines;
+    vector<Label> cachedLabels;
+    bool valid = memcmp(header.magic, programImageMagic, sizeof(programImageMagic)) == 0 &&
+                 header.key == key && inMemoryBounds(header.dataStart, header.dataLength);
+    for (uint32_t i = 0; valid && i < header.instructionCount; ++i) {
+        uint32_t line, length;
+        valid = readU32(line) && readU32(length) && (size_t)(end - cursor) >= length;
+        if (valid) {
+            cachedLines.push_back(line);
+            cachedInstructions.emplace_back(cursor, length);
+            cursor += length;
+        }
+    }
+    for (uint32_t i = 0; valid && i < header.labelCount; ++i) {
+        uint32_t address, length;
+        valid = readU32(address) && readU32(length) && (size_t)(end - cursor) >= length;
+        if (valid) {
+            cachedLabels.push_back({string(cursor, length), (int)address});
+            cursor += length;
+        }
+    }
+    valid = valid && (size_t)(end - cursor) == header.dataLength;
+    if (valid) {
+        instructions.swap(cachedInstructions);
+        instructionLines.swap(cachedLines);
+        labelList.swap(cachedLabels);
+        memcpy(memory + header.dataStart, cursor, header.dataLength);
+        dataSectionEnd = header.dataStart + header.dataLength;
+    }
+    munmap(mapped, size);
+    return valid;
+}
+
+// Writes the freshly parsed program to the cache. Failures are not fatal;
+// the program simply gets parsed again next time.
+void saveProgramImage(uint64_t key) {
+    mkdir(programCacheDir.c_str(), 0755);
+
+    ProgramImageHeader header = {};
+    memcpy(header.magic, programImageMagic, sizeof(programImageMagic));
+    header.key = key;
+    header.instructionCount = instructions.size();
+    header.labelCount = labelList.size();
+    header.dataStart = DATA_SECTION_START;
+    header.dataLength = dataSectionEnd - DATA_SECTION_START;
+
+    string image((const char *)&header, sizeof(header));
+    for (size_t i = 0; i < instructions.size(); ++i) {
+        appendU32(image, instructionLines[i]);
+        appendU32(image, instructions[i].size());
+        image += instructions[i];
+    }
+    for (const auto &lbl : labelList) {
+        appendU32(image, lbl.address);
+        appendU32(image, lbl.name.size());
+        image += lbl.name;
+    }
+    image.append((const char *)memory + header.dataStart, header.dataLength);
+
+    // Write under a temporary name and rename, so readers never see a partial image
+    string path = programCachePath(key);
+    string temporary = path + ".tmp" + to_string(getpid());
+    ofstream out(temporary, ios::binary);
+    out.write(image.data(), image.size());
+    out.close();
+    if (!out || rename(temporary.c_str(), path.c_str()) != 0) {
+        unlink(temporary.c_str());
+    }
+}
+
 bool loadInstructions(const string &filename) {
-    ifstream infile(filename);
+    ifstream infile(filename, ios::binary);
     if (!infile.is_open()) {
         cout << "Error: Could not open file " << filename << endl;
         return false;
     }
+    stringstream source;
+    source << infile.rdbuf();
+    infile.close();
 
     reset();
     instructions.clear();
+    instructionLines.clear();
     labelList.clear();
-    MapLabels(infile, labelList);
-    
-    infile.close();
+    uint64_t key = 0;
+    bool cached = false;
+    if (!programCacheDir.empty()) {
+        key = programCacheKey(source.str());
+        cached = loadProgramImage(key);
+    }
+    if (!cached) {
+        MapLabels(source, labelList);
+        if (!programCacheDir.empty()) {
+            saveProgramImage(key);
+        }
+    }
+    buildDecodeCache();
+    detectCopyLoops();
     return true;
 }
 
@@ -193,6 +893,42 @@ void printRegisters() {
     cout << dec;
 }
 
+// Zicntr/Zihpm user counters, readable by name or CSR number. hpmcounter3-5
+// count loads, stores and taken branches.
+bool readCSR(const string &name, int64_t &value) {
+    int64_t number = -1;
+    if (!parseDataValue(name, number)) {
+        static const unordered_map<string, int> csrNames = {
+            {"cycle", 0xC00}, {"time", 0xC01}, {"instret", 0xC02},
+            {"hpmcounter3", 0xC03}, {"hpmcounter4", 0xC04}, {"hpmcounter5", 0xC05}
+        };
+        auto it = csrNames.find(name);
+        if (it == csrNames.end()) {
+            return false;
+        }
+        number = it->second;
+    }
+    switch (number) {
+        case 0xC00: value = counters.cycles; return true;
+        case 0xC01: value = counters.cycles; return true;
+        case 0xC02: value = counters.instret; return true;
+        case 0xC03: value = counters.loads; return true;
+        case 0xC04: value = counters.stores; return true;
+        case 0xC05: value = counters.branchesTaken; return true;
+    }
+    return false;
+}
+
+void printStats(ostream &out) {
+    out << "{\"instret\": " << counters.instret
+        << ", \"cycles\": " << counters.cycles
+        << ", \"loads\": " << counters.loads
+        << ", \"stores\": " << counters.stores
+        << ", \"branches_taken\": " << counters.branchesTaken
+        << ", \"code_bytes\": " << textSize
+        << ", \"compressed_instructions\": " << compressedCount << "}\n";
+}
+
 void executeInstruction(const string &instruction) {
     stringstream ss(instruction);
     string opcode, rd, rs1, rs2, imm;
@@ -316,6 +1052,7 @@ void executeInstruction(const string &instruction) {
         value |= ((int64_t)(uint8_t)memory[address + i] << (8 * i));
     }
     registers[regNameMap[rd]] = value;
+    counters.loads++;
 }
 
    else if (opcode == "lw") {
@@ -334,6 +1071,7 @@ void executeInstruction(const string &instruction) {
         value |= ((int64_t)(uint8_t)memory[address + i] << (8 * i));
     }
     registers[regNameMap[rd]] = value;
+    counters.loads++;
 }
 
     else if (opcode == "lh") {
@@ -352,6 +1090,7 @@ void executeInstruction(const string &instruction) {
         value |= ((int64_t)(uint8_t)memory[address + i] << (8 * i));
     }
     registers[regNameMap[rd]] = value;
+    counters.loads++;
 }
 
     else if (opcode == "lb") {
@@ -370,6 +1109,7 @@ void executeInstruction(const string &instruction) {
         value |= ((int64_t)(uint8_t)memory[address + i] << (8 * i));
     }
     registers[regNameMap[rd]] = value;
+    counters.loads++;
 }
 
    else if (opcode == "lwu") {
@@ -388,6 +1128,7 @@ void executeInstruction(const string &instruction) {
         value |= ((uint64_t)(uint8_t)memory[address + i] << (8 * i));
     }
     registers[regNameMap[rd]] = value;
+    counters.loads++;
 }
 
     else if (opcode == "lhu") {
@@ -400,6 +1141,7 @@ void executeInstruction(const string &instruction) {
             value |= ((uint16_t)memory[address + i] << (8 * i));
         }
         registers[regNameMap[rd]] = value;
+        counters.loads++;
     }
 
     else if (opcode == "lbu") {
@@ -418,6 +1160,7 @@ void executeInstruction(const string &instruction) {
         value |= ((uint64_t)(uint8_t)memory[address + i] << (8 * i));
     }
     registers[regNameMap[rd]] = value;
+    counters.loads++;
 }
 
  else if (opcode == "sd") {
@@ -435,6 +1178,7 @@ void executeInstruction(const string &instruction) {
     for (int i = 0; i < 8; ++i) {
         memory[address + i] = (uint8_t)((value >> (8 * i)) & 0xFF);
     }
+    noteStore(address, 8);
 }
 
     else if (opcode == "sw") {
@@ -452,6 +1196,7 @@ void executeInstruction(const string &instruction) {
     for (int i = 0; i < 4; ++i) {
         memory[address + i] = (uint8_t)((value >> (8 * i)) & 0xFF);
     }
+    noteStore(address, 4);
 }
     else if (opcode == "sh") {
     ss >> rs2 >> imm >> rs1;
@@ -468,6 +1213,7 @@ void executeInstruction(const string &instruction) {
     for (int i = 0; i < 2; ++i) {
         memory[address + i] = (uint8_t)((value >> (8 * i)) & 0xFF);
     }
+    noteStore(address, 2);
 }
     else if (opcode == "sb") {
     ss >> rs2 >> imm >> rs1;
@@ -484,6 +1230,7 @@ void executeInstruction(const string &instruction) {
     for (int i = 0; i < 1; ++i) {
         memory[address + i] = (uint8_t)((value >> (8 * i)) & 0xFF);
     }
+    noteStore(address, 1);
 }
     else if (opcode == "beq") {
         ss >> rs1 >> rs2 >> imm;
@@ -496,7 +1243,7 @@ void executeInstruction(const string &instruction) {
         // Check if the third operand (imm/label) is a label
         for (const auto& lbl : labelList) {
             if (lbl.name == imm) {
-                targetPC = lbl.address * 4; // Set the target address from the label
+                targetPC = instructionAddressOf(lbl.address); // Set the target address from the label
                 isLabel = true;
                 break;
             }
@@ -504,11 +1251,12 @@ void executeInstruction(const string &instruction) {
 
         // If not a label, treat it as an immediate value (integer offset)
         if (!isLabel) {
-            targetPC = PC + stoi(imm) * 4; // Immediate value specifies offset in instructions, so multiply by 4
+            targetPC = relativeTarget(stoi(imm)); // Immediate value specifies offset in instructions
         }
 
         // Perform the branch if the condition is met
         if (registers[regNameMap[rs1]] == registers[regNameMap[rs2]]) {
+            counters.branchesTaken++;
             PC = targetPC;
             return; // Return to avoid incrementing PC after branching
         }
@@ -524,7 +1272,7 @@ void executeInstruction(const string &instruction) {
         // Check if the third operand (imm/label) is a label
         for (const auto& lbl : labelList) {
             if (lbl.name == imm) {
-                targetPC = lbl.address * 4; // Set the target address from the label
+                targetPC = instructionAddressOf(lbl.address); // Set the target address from the label
                 isLabel = true;
                 break;
             }
@@ -532,11 +1280,12 @@ void executeInstruction(const string &instruction) {
 
         // If not a label, treat it as an immediate value (integer offset)
         if (!isLabel) {
-            targetPC = PC + stoi(imm) * 4; // Immediate value specifies offset in instructions, so multiply by 4
+            targetPC = relativeTarget(stoi(imm)); // Immediate value specifies offset in instructions
         }
 
         // Perform the branch if the condition is met
         if (registers[regNameMap[rs1]] != registers[regNameMap[rs2]]) {
+            counters.branchesTaken++;
             PC = targetPC;
             return; // Return to avoid incrementing PC after branching
         }
@@ -552,7 +1301,7 @@ void executeInstruction(const string &instruction) {
         // Check if the third operand (imm/label) is a label
         for (const auto& lbl : labelList) {
             if (lbl.name == imm) {
-                targetPC = lbl.address * 4; // Set the target address from the label
+                targetPC = instructionAddressOf(lbl.address); // Set the target address from the label
                 isLabel = true;
                 break;
             }
@@ -560,11 +1309,12 @@ void executeInstruction(const string &instruction) {
 
         // If not a label, treat it as an immediate value (integer offset)
         if (!isLabel) {
-            targetPC = PC + stoi(imm) * 4; // Immediate value specifies offset in instructions, so multiply by 4
+            targetPC = relativeTarget(stoi(imm)); // Immediate value specifies offset in instructions
         }
 
         // Perform the branch if the condition is met
         if (registers[regNameMap[rs1]] < registers[regNameMap[rs2]]) {
+            counters.branchesTaken++;
             PC = targetPC;
             return; // Return to avoid incrementing PC after branching
         }
@@ -581,7 +1331,7 @@ void executeInstruction(const string &instruction) {
         // Check if the third operand (imm/label) is a label
         for (const auto& lbl : labelList) {
             if (lbl.name == imm) {
-                targetPC = lbl.address * 4; // Set the target address from the label
+                targetPC = instructionAddressOf(lbl.address); // Set the target address from the label
                 isLabel = true;
                 break;
             }
@@ -589,11 +1339,12 @@ void executeInstruction(const string &instruction) {
 
         // If not a label, treat it as an immediate value (integer offset)
         if (!isLabel) {
-            targetPC = PC + stoi(imm) * 4; // Immediate value specifies offset in instructions, so multiply by 4
+            targetPC = relativeTarget(stoi(imm)); // Immediate value specifies offset in instructions
         }
 
         // Perform the branch if the condition is met
         if (registers[regNameMap[rs1]] >= registers[regNameMap[rs2]]) {
+            counters.branchesTaken++;
             PC = targetPC;
             return; // Return to avoid incrementing PC after branching
         }
@@ -609,7 +1360,7 @@ void executeInstruction(const string &instruction) {
         // Check if the third operand (imm/label) is a label
         for (const auto& lbl : labelList) {
             if (lbl.name == imm) {
-                targetPC = lbl.address * 4; // Set the target address from the label
+                targetPC = instructionAddressOf(lbl.address); // Set the target address from the label
                 isLabel = true;
                 break;
             }
@@ -617,11 +1368,12 @@ void executeInstruction(const string &instruction) {
 
         // If not a label, treat it as an immediate value (integer offset)
         if (!isLabel) {
-            targetPC = PC + stoi(imm) * 4; // Immediate value specifies offset in instructions, so multiply by 4
+            targetPC = relativeTarget(stoi(imm)); // Immediate value specifies offset in instructions
         }
 
         // Perform the branch if the condition is met
         if ((unsigned int)registers[regNameMap[rs1]] >= (unsigned int)registers[regNameMap[rs2]]) {
+            counters.branchesTaken++;
             PC = targetPC;
             return; // Return to avoid incrementing PC after branching
         }
@@ -637,7 +1389,7 @@ void executeInstruction(const string &instruction) {
         // Check if the third operand (imm/label) is a label
         for (const auto& lbl : labelList) {
             if (lbl.name == imm) {
-                targetPC = lbl.address * 4; // Set the target address from the label
+                targetPC = instructionAddressOf(lbl.address); // Set the target address from the label
                 isLabel = true;
                 break;
             }
@@ -645,11 +1397,12 @@ void executeInstruction(const string &instruction) {
 
         // If not a label, treat it as an immediate value (integer offset)
         if (!isLabel) {
-            targetPC = PC + stoi(imm) * 4; // Immediate value specifies offset in instructions, so multiply by 4
+            targetPC = relativeTarget(stoi(imm)); // Immediate value specifies offset in instructions
         }
 
         // Perform the branch if the condition is met
         if ((unsigned int)registers[regNameMap[rs1]] < (unsigned int)registers[regNameMap[rs2]]) {
+            counters.branchesTaken++;
             PC = targetPC;
             return; // Return to avoid incrementing PC after branching
         }
@@ -663,17 +1416,19 @@ void executeInstruction(const string &instruction) {
 
         for (const auto& lbl : labelList) {
             if (lbl.name == imm) {
-                targetPC = lbl.address * 4; 
+                targetPC = instructionAddressOf(lbl.address);
                 isLabel = true;
                 break;
             }
         }
 
         if (!isLabel) {
-            targetPC = PC + stoi(imm) * 4; // Immediate value specifies offset in instructions, so multiply by 4
+            targetPC = relativeTarget(stoi(imm)); // Immediate value specifies offset in instructions
         }
 
-        registers[regNameMap[rd]] = PC + 4;
+        if (regNameMap[rd] != 0) {
+            registers[regNameMap[rd]] = PC + currentInstructionLength;
+        }
         
         PC = targetPC;
         return; 
@@ -690,61 +1445,875 @@ void executeInstruction(const string &instruction) {
         int targetPC = (registers[regNameMap[rs1]] + stoi(imm)) & ~1;
 
         if (regNameMap[rd] != 0) { 
-            registers[regNameMap[rd]] = PC + 4;
+            registers[regNameMap[rd]] = PC + currentInstructionLength;
         }
 
         PC = targetPC;
         return;
     }
+    else if (opcode == "csrrs" || opcode == "csrrc" || opcode == "csrr" ||
+             opcode == "rdcycle" || opcode == "rdtime" || opcode == "rdinstret") {
+        string csr = opcode.substr(2);  // rdcycle -> cycle
+        ss >> rd;
+        if (opcode.compare(0, 3, "csr") == 0) {
+            ss >> csr >> rs1;
+        }
+        if (!rd.empty() && rd.back() == ',') {
+            rd = rd.substr(0, rd.length() - 1);
+        }
+        if (!csr.empty() && csr.back() == ',') {
+            csr = csr.substr(0, csr.length() - 1);
+        }
+        int64_t value;
+        if (!rs1.empty() && regNameMap[rs1] != 0) {
+            cout << "Error: CSR " << csr << " is read-only\n";
+        } else if (!readCSR(csr, value)) {
+            cout << "Error: Unknown CSR " << csr << "\n";
+        } else if (regNameMap[rd] != 0) {
+            registers[regNameMap[rd]] = value;
+        }
+    }
     else if (opcode == "lui") {
         ss >> rd >> imm;
         rd = rd.substr(0, rd.length() - 1);
         registers[regNameMap[rd]] = stoi(imm, nullptr, 0) << 12; 
     }
 
-    PC += 4; 
+    PC += currentInstructionLength;
+}
+
+// Executes the instruction at PC and retires it
+void retireInstruction() {
+    const DecodedInstruction &insn = decoded[fetchIndex(PC)];
+    currentInstructionLength = insn.length;
+    executeInstruction(insn.text);
+    counters.instret++;
+    counters.cycles++;
+}
+
+// Runs a recognised copy/fill loop as one host memmove/memset. Returns false
+// (without touching any state) if the loop does not terminate cleanly by
+// counting, would go out of bounds, or overlaps in a way memmove can't
+// reproduce; the caller then interprets it instruction by instruction.
+bool runCopyLoop(const CopyLoop &loop) {
+    int64_t step = 0;
+    for (const auto &inc : loop.increments) {
+        if (inc.first == loop.counter) {
+            step = inc.second;
+        }
+    }
+    int64_t distance = registers[loop.bound] - registers[loop.counter];
+    if (step == 0 || distance % step != 0 || distance / step <= 0 ||
+        distance / step > memory_size / loop.width) {
+        return false;
+    }
+    int64_t iterations = distance / step;
+    int count = (int)(iterations * loop.width);
+
+    int64_t dst = registers[loop.storeBase] + loop.storeOffset;
+    if (dst < 0 || dst > memory_size - count) {
+        return false;
+    }
+    int64_t lastValue = 0;
+    if (loop.isCopy) {
+        int64_t src = registers[loop.loadBase] + loop.loadOffset;
+        if (src < 0 || src > memory_size - count) {
+            return false;
+        }
+        if (dst > src && dst < src + count) {
+            return false;  // Forward copy would re-read bytes it just stored
+        }
+        // Loads are zero-extended, as in executeInstruction
+        int last = (int)src + count - loop.width;
+        for (int i = 0; i < loop.width; ++i) {
+            lastValue |= (int64_t)memory[last + i] << (8 * i);
+        }
+        memoryCopy((int)dst, (int)src, count);
+        markDirty((int)dst, count);
+    } else {
+        int64_t value = registers[loop.storeSrc];
+        uint8_t pattern[8];
+        for (int i = 0; i < 8; ++i) {
+            pattern[i] = (value >> (8 * i)) & 0xFF;
+        }
+        if (loop.width == 1 || all_of(pattern + 1, pattern + loop.width, [&](uint8_t b) { return b == pattern[0]; })) {
+            memoryFill((int)dst, pattern[0], count);
+        } else {
+            // Seed one element, then keep doubling the filled prefix
+            memcpy(memory + dst, pattern, loop.width);
+            for (int filled = loop.width; filled < count; filled *= 2) {
+                memcpy(memory + dst + filled, memory + dst, min(filled, count - filled));
+            }
+        }
+        markDirty((int)dst, count);
+    }
+
+    for (const auto &inc : loop.increments) {
+        registers[inc.first] += iterations * inc.second;
+    }
+    if (loop.isCopy) {
+        registers[loop.loadRd] = lastValue;
+        counters.loads += iterations;
+    }
+    counters.stores += iterations;
+    counters.branchesTaken += iterations - 1;
+    counters.instret += iterations * loop.length;
+    counters.cycles += iterations * loop.length;
+    PC = instructionAddressOf(loop.head + loop.length);
+    return true;
+}
+
+// The host fast path skips individual instructions, so anything that needs
+// to stop mid-loop turns it off.
+bool copyLoopFastPathEnabled() {
+    return breakpoints.empty() && watchpoints.empty();
 }
 
 void runProgram() {
-    while (PC / 4 < instructions.size()) {
+    while (pcInProgram(PC)) {
         if (find(breakpoints.begin(), breakpoints.end(), PC) != breakpoints.end()) {
             cout << "Execution stopped at breakpoint\n";
             return;  // Exit the function to pause execution
         }
-        cout << "Executed " << instructions[PC / 4] << " ; PC = 0x" << setw(8) << setfill('0') << hex << PC << "\n";
-        executeInstruction(instructions[PC / 4]);
+        if (copyLoopFastPathEnabled()) {
+            auto loop = copyLoops.find(fetchIndex(PC));
+            int loopPC = PC;
+            if (loop != copyLoops.end() && runCopyLoop(loop->second)) {
+                cout << "Executed " << (loop->second.isCopy ? "copy" : "fill") << " loop on host ; PC = 0x"
+                     << setw(8) << setfill('0') << hex << loopPC << "\n";
+                continue;
+            }
+        }
+        cout << "Executed " << instructions[fetchIndex(PC)] << " ; PC = 0x" << setw(8) << setfill('0') << hex << PC << "\n";
+        retireInstruction();
     }
     cout << dec; 
 }
 
+static const char hexDigits[] = "0123456789abcdef";
+
+static char *formatHex(char *out, unsigned int value, int digits) {
+    for (int i = digits - 1; i >= 0; --i) {
+        out[i] = hexDigits[value & 0xF];
+        value >>= 4;
+    }
+    return out + digits;
+}
+
 void printMemory(int addr, int count) {
-    for (int i = 0; i < count; ++i) {
-        if ((addr + i) < 0x50000) { 
-            // Print each byte as a two-digit hexadecimal value
-            cout << "Memory[0x" << setw(8) << setfill('0') << (addr + i) <<"] : 0x"
-                 << setw(2) << setfill('0') << (memory[addr + i] & 0xFF) << "\n";
-        } else {
-            cout << "Error: Address out of bounds.\n";
-            break;
+    // Format into one buffer and hand it to cout in a single write
+    int valid = 0;
+    if (addr >= 0 && addr < memory_size && count > 0) {
+        valid = min(count, memory_size - addr);
+    }
+    const int lineLength = 30;  // "Memory[0x%08x] : 0x%02x\n"
+    string buffer(valid * lineLength, '\0');
+    char *out = &buffer[0];
+    for (int i = 0; i < valid; ++i) {
+        memcpy(out, "Memory[0x", 9);
+        out = formatHex(out + 9, addr + i, 8);
+        memcpy(out, "] : 0x", 6);
+        out = formatHex(out + 6, memory[addr + i], 2);
+        *out++ = '\n';
+    }
+    cout.write(buffer.data(), out - buffer.data());
+    if (valid < count) {
+        cout << "Error: Address out of bounds.\n";
+    }
+}
+
+// Hexdump with 16 bytes per line: address, hex bytes, then printable ASCII.
+void dumpMemory(int addr, int count) {
+    if (addr < 0 || addr >= memory_size || count < 0) {
+        cout << "Error: Address out of bounds.\n";
+        return;
+    }
+    count = min(count, memory_size - addr);
+    const int lineLength = 8 + 2 + 16 * 3 + 1 + 16 + 1;
+    string buffer(((count + 15) / 16) * lineLength, '\0');
+    char *out = &buffer[0];
+    for (int line = 0; line < count; line += 16) {
+        int n = min(16, count - line);
+        const uint8_t *bytes = memory + addr + line;
+        out = formatHex(out, addr + line, 8);
+        *out++ = ':';
+        *out++ = ' ';
+        for (int i = 0; i < 16; ++i) {
+            if (i < n) {
+                out[0] = hexDigits[bytes[i] >> 4];
+                out[1] = hexDigits[bytes[i] & 0xF];
+            } else {
+                out[0] = out[1] = ' ';
+            }
+            out[2] = ' ';
+            out += 3;
+        }
+        *out++ = ' ';
+        for (int i = 0; i < n; ++i) {
+            *out++ = (bytes[i] >= 0x20 && bytes[i] < 0x7F) ? (char)bytes[i] : '.';
         }
+        *out++ = '\n';
     }
-    cout << dec;  // Reset number format to decimal
+    cout.write(buffer.data(), out - buffer.data());
 }
 
 void stepProgram() {
-    if (PC / 4 < instructions.size()) {
-        cout << "Executed " << instructions[PC / 4] << " ; PC = 0x" << setw(8) << setfill('0') << hex << PC << "\n";
-        executeInstruction(instructions[PC / 4]);
+    if (pcInProgram(PC)) {
+        cout << "Executed " << instructions[fetchIndex(PC)] << " ; PC = 0x" << setw(8) << setfill('0') << hex << PC << "\n";
+        retireInstruction();
     } else {
         cout << "Nothing to step\n";
     }
     cout << dec;
 }
 
-int main() {
+// ---------------------------------------------------------------------------
+// GDB remote serial protocol stub
+//
+// "gdbserver <port>" listens on 127.0.0.1:<port>, "gdbserver <path>" on a Unix
+// socket. Registers are x0-x31 followed by pc, 64 bits each. Supports g/G/p/P,
+// m/M plus binary X/x for bulk memory, Z0/z0 breakpoints, Z2/z2 write
+// watchpoints, c/s and Ctrl-C.
+// ---------------------------------------------------------------------------
+
+const int gdbPacketSize = 0x20000;
+int gdbFd = -1;
+string gdbInput;                    // Bytes received but not yet consumed
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static void appendHexBytes(string &out, const uint8_t *bytes, int count) {
+    size_t start = out.size();
+    out.resize(start + 2 * count);
+    for (int i = 0; i < count; ++i) {
+        out[start + 2 * i] = hexDigits[bytes[i] >> 4];
+        out[start + 2 * i + 1] = hexDigits[bytes[i] & 0xF];
+    }
+}
+
+static bool decodeHexBytes(const string &text, size_t pos, vector<uint8_t> &bytes) {
+    if ((text.size() - pos) % 2 != 0) {
+        return false;
+    }
+    bytes.resize((text.size() - pos) / 2);
+    for (size_t i = 0; i < bytes.size(); ++i) {
+        int hi = hexValue(text[pos + 2 * i]);
+        int lo = hexValue(text[pos + 2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        bytes[i] = (uint8_t)(hi << 4 | lo);
+    }
+    return true;
+}
+
+// Parses a hex number starting at pos and leaves pos on the first non-hex char
+static uint64_t parseHex(const string &text, size_t &pos) {
+    uint64_t value = 0;
+    while (pos < text.size() && hexValue(text[pos]) >= 0) {
+        value = value << 4 | hexValue(text[pos++]);
+    }
+    return value;
+}
+
+static bool gdbFill() {
+    char buffer[4096];
+    ssize_t n = recv(gdbFd, buffer, sizeof(buffer), 0);
+    if (n <= 0) {
+        return false;
+    }
+    gdbInput.append(buffer, n);
+    return true;
+}
+
+static void gdbWrite(const string &data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(gdbFd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return;
+        }
+        sent += n;
+    }
+}
+
+// Frames and sends one packet, escaping the characters the protocol reserves
+static void gdbSendPacket(const string &payload) {
+    string packet = "$";
+    uint8_t checksum = 0;
+    for (char c : payload) {
+        if (c == '$' || c == '#' || c == '}' || c == '*') {
+            packet += '}';
+            checksum += '}';
+            c ^= 0x20;
+        }
+        packet += c;
+        checksum += (uint8_t)c;
+    }
+    packet += '#';
+    packet += hexDigits[checksum >> 4];
+    packet += hexDigits[checksum & 0xF];
+    gdbWrite(packet);
+}
+
+// Reads the next packet and acknowledges it. A bare Ctrl-C is returned as
+// "\x03". Returns false once the connection is closed.
+static bool gdbReadPacket(string &payload) {
+    while (true) {
+        size_t start = gdbInput.find_first_of("$\x03");
+        if (start == string::npos) {
+            gdbInput.clear();
+        } else if (gdbInput[start] == '\x03') {
+            gdbInput.erase(0, start + 1);
+            payload = "\x03";
+            return true;
+        } else {
+            size_t end = gdbInput.find('#', start);
+            if (end != string::npos && end + 2 < gdbInput.size()) {
+                string raw = gdbInput.substr(start + 1, end - start - 1);
+                gdbInput.erase(0, end + 3);
+                gdbWrite("+");
+                payload.clear();
+                for (size_t i = 0; i < raw.size(); ++i) {
+                    if (raw[i] == '}' && i + 1 < raw.size()) {
+                        payload += (char)(raw[++i] ^ 0x20);
+                    } else {
+                        payload += raw[i];
+                    }
+                }
+                return true;
+            }
+        }
+        if (!gdbFill()) {
+            return false;
+        }
+    }
+}
+
+// True if gdb sent a Ctrl-C while the target was running
+static bool gdbInterrupted() {
+    char buffer[256];
+    ssize_t n = recv(gdbFd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (n > 0) {
+        gdbInput.append(buffer, n);
+    }
+    size_t pos = gdbInput.find('\x03');
+    if (pos == string::npos) {
+        return false;
+    }
+    gdbInput.erase(pos, 1);
+    return true;
+}
+
+static string gdbTargetXml() {
+    static const char *abiNames[no_of_registers] = {
+        "zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2", "fp", "s1", "a0", "a1", "a2", "a3", "a4", "a5",
+        "a6", "a7", "s2", "s3", "s4", "s5", "s6", "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6"
+    };
+    string xml = "<?xml version=\"1.0\"?><!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+                 "<target version=\"1.0\"><architecture>riscv:rv64</architecture>"
+                 "<feature name=\"org.gnu.gdb.riscv.cpu\">";
+    for (int i = 0; i < no_of_registers; ++i) {
+        const char *type = (i == 1) ? "code_ptr" : (i == 2 || i == 8) ? "data_ptr" : "int";
+        xml += string("<reg name=\"") + abiNames[i] + "\" bitsize=\"64\" type=\"" + type +
+               "\" regnum=\"" + to_string(i) + "\"/>";
+    }
+    xml += "<reg name=\"pc\" bitsize=\"64\" type=\"code_ptr\" regnum=\"32\"/></feature></target>";
+    return xml;
+}
+
+static int64_t gdbRegister(int n) {
+    return n == no_of_registers ? (int64_t)PC : registers[n];
+}
+
+// Writes to x0 are ignored so it always reads back as zero
+static void gdbSetRegister(int n, int64_t value) {
+    if (n == no_of_registers) {
+        PC = (int)value;
+    } else if (n != 0) {
+        registers[n] = value;
+    }
+}
+
+// Runs until a breakpoint, watchpoint, Ctrl-C or the end of the program and
+// returns the stop reply
+static string gdbResume(bool singleStep) {
+    watchpointHit = -1;
+    bool first = true;
+    long executed = 0;
+    while (pcInProgram(PC)) {
+        if (!first && find(breakpoints.begin(), breakpoints.end(), PC) != breakpoints.end()) {
+            return "S05";
+        }
+        if (!first && singleStep) {
+            return "S05";
+        }
+        first = false;
+        auto loop = copyLoops.find(fetchIndex(PC));
+        if (singleStep || !copyLoopFastPathEnabled() || loop == copyLoops.end() || !runCopyLoop(loop->second)) {
+            retireInstruction();
+        }
+        if (watchpointHit >= 0) {
+            char reply[48];
+            snprintf(reply, sizeof(reply), "T05watch:%x;", watchpointHit);
+            return reply;
+        }
+        if (++executed % 65536 == 0 && gdbInterrupted()) {
+            return "S02";
+        }
+    }
+    return "W00";
+}
+
+// Handles one packet; returns false when the session should end
+static bool gdbHandlePacket(const string &packet) {
+    if (packet == "\x03") {
+        gdbSendPacket("S02");
+        return true;
+    }
+    char kind = packet.empty() ? 0 : packet[0];
+    size_t pos = 1;
+    if (kind == '?') {
+        gdbSendPacket("S05");
+    } else if (kind == 'g') {
+        string reply;
+        for (int i = 0; i <= no_of_registers; ++i) {
+            int64_t value = gdbRegister(i);
+            appendHexBytes(reply, (const uint8_t *)&value, 8);
+        }
+        gdbSendPacket(reply);
+    } else if (kind == 'G') {
+        vector<uint8_t> bytes;
+        if (!decodeHexBytes(packet, 1, bytes) || bytes.size() < 8 * (no_of_registers + 1)) {
+            gdbSendPacket("E01");
+            return true;
+        }
+        for (int i = 0; i <= no_of_registers; ++i) {
+            int64_t value;
+            memcpy(&value, &bytes[8 * i], 8);
+            gdbSetRegister(i, value);
+        }
+        gdbSendPacket("OK");
+    } else if (kind == 'p') {
+        uint64_t n = parseHex(packet, pos);
+        if (n > (uint64_t)no_of_registers) {
+            gdbSendPacket("E01");
+            return true;
+        }
+        int64_t value = gdbRegister(n);
+        string reply;
+        appendHexBytes(reply, (const uint8_t *)&value, 8);
+        gdbSendPacket(reply);
+    } else if (kind == 'P') {
+        uint64_t n = parseHex(packet, pos);
+        vector<uint8_t> bytes;
+        if (n > (uint64_t)no_of_registers || pos >= packet.size() || packet[pos] != '=' ||
+            !decodeHexBytes(packet, pos + 1, bytes) || bytes.size() != 8) {
+            gdbSendPacket("E01");
+            return true;
+        }
+        int64_t value;
+        memcpy(&value, bytes.data(), 8);
+        gdbSetRegister(n, value);
+        gdbSendPacket("OK");
+    } else if (kind == 'm' || kind == 'x') {
+        uint64_t addr = parseHex(packet, pos);
+        ++pos;
+        uint64_t length = parseHex(packet, pos);
+        if (kind == 'x' && length == 0) {
+            gdbSendPacket("OK");
+            return true;
+        }
+        if (addr >= (uint64_t)memory_size || length > (uint64_t)gdbPacketSize / 2) {
+            gdbSendPacket("E01");
+            return true;
+        }
+        int count = (int)min<uint64_t>(length, memory_size - addr);
+        if (kind == 'x') {
+            gdbSendPacket("b" + string((const char *)memory + addr, count));
+        } else {
+            string reply;
+            appendHexBytes(reply, memory + addr, count);
+            gdbSendPacket(reply);
+        }
+    } else if (kind == 'M' || kind == 'X') {
+        uint64_t addr = parseHex(packet, pos);
+        ++pos;
+        uint64_t length = parseHex(packet, pos);
+        if (pos >= packet.size() || packet[pos] != ':' || addr > (uint64_t)memory_size ||
+            length > memory_size - addr) {
+            gdbSendPacket("E01");
+            return true;
+        }
+        ++pos;
+        vector<uint8_t> bytes;
+        if (kind == 'X') {
+            bytes.assign(packet.begin() + pos, packet.end());
+        } else if (!decodeHexBytes(packet, pos, bytes)) {
+            gdbSendPacket("E01");
+            return true;
+        }
+        if (bytes.size() != length) {
+            gdbSendPacket("E01");
+            return true;
+        }
+        memcpy(memory + addr, bytes.data(), length);
+        gdbSendPacket("OK");
+    } else if (kind == 'c' || kind == 's') {
+        if (pos < packet.size()) {
+            PC = (int)parseHex(packet, pos);
+        }
+        string reply = gdbResume(kind == 's');
+        gdbSendPacket(reply);
+        if (reply == "W00") {
+            cout << "Program finished under gdb\n";
+        }
+    } else if ((kind == 'Z' || kind == 'z') && packet.size() > 3) {
+        char type = packet[1];
+        pos = 3;
+        uint64_t start = parseHex(packet, pos);
+        ++pos;
+        uint64_t size = parseHex(packet, pos);
+        // Breakpoints take any int PC; watchpoints must cover guest memory
+        bool valid = (type == '0') ? start <= INT32_MAX
+                                   : start < (uint64_t)memory_size && size >= 1 && size <= memory_size - start;
+        if ((type == '0' || type == '2') && !valid) {
+            gdbSendPacket("E01");
+            return true;
+        }
+        int addr = (int)start;
+        int length = (int)size;
+        if (type == '0') {
+            auto it = find(breakpoints.begin(), breakpoints.end(), addr);
+            if (kind == 'Z' && it == breakpoints.end()) {
+                breakpoints.push_back(addr);
+            } else if (kind == 'z' && it != breakpoints.end()) {
+                breakpoints.erase(it);
+            }
+            gdbSendPacket("OK");
+        } else if (type == '2') {
+            auto it = find_if(watchpoints.begin(), watchpoints.end(), [&](const Watchpoint &wp) {
+                return wp.address == addr && wp.length == length;
+            });
+            if (kind == 'Z' && it == watchpoints.end()) {
+                watchpoints.push_back({addr, length});
+            } else if (kind == 'z' && it != watchpoints.end()) {
+                watchpoints.erase(it);
+            }
+            gdbSendPacket("OK");
+        } else {
+            gdbSendPacket("");
+        }
+    } else if (packet.compare(0, 10, "qSupported") == 0) {
+        char reply[96];
+        snprintf(reply, sizeof(reply), "PacketSize=%x;qXfer:features:read+;binary-upload+", gdbPacketSize);
+        gdbSendPacket(reply);
+    } else if (packet.compare(0, 31, "qXfer:features:read:target.xml:") == 0) {
+        string xml = gdbTargetXml();
+        pos = 31;
+        size_t offset = parseHex(packet, pos);
+        ++pos;
+        size_t length = parseHex(packet, pos);
+        if (offset >= xml.size()) {
+            gdbSendPacket("l");
+        } else {
+            string chunk = xml.substr(offset, length);
+            gdbSendPacket((offset + chunk.size() < xml.size() ? "m" : "l") + chunk);
+        }
+    } else if (packet == "qAttached") {
+        gdbSendPacket("1");
+    } else if (packet == "qfThreadInfo") {
+        gdbSendPacket("m1");
+    } else if (packet == "qsThreadInfo") {
+        gdbSendPacket("l");
+    } else if (packet == "qC") {
+        gdbSendPacket("QC1");
+    } else if (kind == 'H' || kind == 'T') {
+        gdbSendPacket("OK");
+    } else if (kind == 'D') {
+        gdbSendPacket("OK");
+        return false;
+    } else if (kind == 'k') {
+        return false;
+    } else {
+        gdbSendPacket("");  // Unsupported packet
+    }
+    return true;
+}
+
+// Opens the listening socket, serves a single gdb connection and returns to
+// the command prompt when gdb detaches or disconnects
+void runGdbServer(const string &endpoint) {
+    bool isPort = !endpoint.empty() && all_of(endpoint.begin(), endpoint.end(), ::isdigit);
+    int listenFd = socket(isPort ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        cout << "Error: Could not create socket\n";
+        return;
+    }
+    int bound;
+    if (isPort) {
+        int reuse = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(stoi(endpoint));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bound = ::bind(listenFd, (sockaddr *)&addr, sizeof(addr));
+    } else {
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, endpoint.c_str(), sizeof(addr.sun_path) - 1);
+        unlink(endpoint.c_str());
+        bound = ::bind(listenFd, (sockaddr *)&addr, sizeof(addr));
+    }
+    if (bound < 0 || listen(listenFd, 1) < 0) {
+        cout << "Error: Could not listen on " << endpoint << "\n";
+        close(listenFd);
+        return;
+    }
+    cout << "Waiting for gdb on " << endpoint << "\n" << flush;
+    gdbFd = accept(listenFd, nullptr, nullptr);
+    close(listenFd);
+    if (!isPort) {
+        unlink(endpoint.c_str());
+    }
+    if (gdbFd < 0) {
+        cout << "Error: Could not accept connection\n";
+        return;
+    }
+    cout << "gdb connected\n";
+    gdbInput.clear();
+    string packet;
+    while (gdbReadPacket(packet) && gdbHandlePacket(packet)) {
+    }
+    close(gdbFd);
+    gdbFd = -1;
+    watchpoints.clear();
+    cout << "gdb disconnected\n";
+}
+
+// ---------------------------------------------------------------------------
+// Differential co-simulation
+//
+// "cosim [N]" runs the program on the fast engine (the run loop with the host
+// copy-loop path) while the plain executeInstruction interpreter runs on a
+// separate copy of the machine state. Every N blocks, the reference catches
+// up to the same instret, and then registers, PC, counters and every memory
+// page stored to since the last check are compared. A block ends at a taken
+// control transfer or before a copy-loop head; a host-executed loop is a block
+// of its own. "cosim insn [N]" counts single instructions instead of blocks.
+// On a mismatch the run is replayed from the start to the last matching
+// check and then compared after every instruction, so the report names the
+// instruction (or host-executed loop) that diverged.
+// ---------------------------------------------------------------------------
+
+struct MachineState {
+    int64_t registers[no_of_registers];
+    int PC;
+    Counters counters;
+    uint8_t *memory;
+};
+
+void swapMachineState(MachineState &other) {
+    swap_ranges(begin(registers), end(registers), begin(other.registers));
+    swap(PC, other.PC);
+    swap(counters, other.counters);
+    swap(memory, other.memory);
+}
+
+// Advances the fast engine by one block (or one instruction). A block never
+// runs into a copy-loop head: the host-executed loop is always a block of its
+// own. Returns true if the step was a host-executed loop.
+bool fastEngineStep(bool singleInstruction) {
+    bool first = true;
+    while (pcInProgram(PC)) {
+        auto loop = copyLoops.find(fetchIndex(PC));
+        if (copyLoopFastPathEnabled() && loop != copyLoops.end()) {
+            if (!first) {
+                return false;
+            }
+            if (runCopyLoop(loop->second)) {
+                return true;
+            }
+        }
+        first = false;
+        int previousPC = PC;
+        retireInstruction();
+        if (singleInstruction || PC != previousPC + currentInstructionLength) {
+            return false;
+        }
+    }
+    return false;
+}
+
+string describeInstruction(int pc) {
+    int index = fetchIndex(pc);
+    if (index < 0) {
+        return "<end of program>";
+    }
+    stringstream out;
+    out << "line " << instructionLines[index] << ": " << instructions[index];
+    return out.str();
+}
+
+// Compares the active (fast) state against the reference, optionally printing
+// every difference. Returns true if they match.
+bool compareMachineState(const MachineState &reference, bool print) {
+    bool match = true;
+    stringstream report;
+    report << hex << setfill('0');
+    for (int i = 0; i < no_of_registers; ++i) {
+        if (registers[i] != reference.registers[i]) {
+            report << "  x" << dec << i << hex << ": engine 0x" << setw(16) << registers[i]
+                   << ", reference 0x" << setw(16) << reference.registers[i] << "\n";
+            match = false;
+        }
+    }
+    if (PC != reference.PC) {
+        report << "  PC: engine 0x" << setw(8) << PC << ", reference 0x" << setw(8) << reference.PC << "\n";
+        match = false;
+    }
+    const pair<const char *, uint64_t Counters::*> counterFields[] = {
+        {"instret", &Counters::instret}, {"loads", &Counters::loads},
+        {"stores", &Counters::stores}, {"branches_taken", &Counters::branchesTaken}
+    };
+    for (const auto &field : counterFields) {
+        if (counters.*field.second != reference.counters.*field.second) {
+            report << "  " << field.first << ": engine " << dec << counters.*field.second
+                   << ", reference " << reference.counters.*field.second << hex << "\n";
+            match = false;
+        }
+    }
+    int reported = 0;
+    for (size_t page = 0; page < dirtyPages.size(); ++page) {
+        if (!dirtyPages[page]) {
+            continue;
+        }
+        int start = page * dirtyPageSize;
+        int length = min(dirtyPageSize, memory_size - start);
+        if (memcmp(memory + start, reference.memory + start, length) == 0) {
+            continue;
+        }
+        match = false;
+        for (int addr = start; addr < start + length && reported < 8; ++addr) {
+            if (memory[addr] != reference.memory[addr]) {
+                report << "  Memory[0x" << setw(8) << addr << "]: engine 0x" << setw(2) << (int)memory[addr]
+                       << ", reference 0x" << setw(2) << (int)reference.memory[addr] << "\n";
+                ++reported;
+            }
+        }
+    }
+    fill(dirtyPages.begin(), dirtyPages.end(), 0);
+    if (!match && print) {
+        cout << report.str();
+    }
+    return match;
+}
+
+// Runs both engines in lockstep from the current state, comparing every
+// interval steps. Returns false at the first mismatch, with matchedSteps
+// set to the last step count at which the states agreed and failedPC and
+// hostLoop describing the step that diverged.
+bool runLockstep(MachineState &reference, int interval, bool singleInstruction, bool print,
+                 long &matchedSteps, long &checks, int &failedPC, bool &hostLoop) {
+    long steps = 0;
+    while (pcInProgram(PC)) {
+        failedPC = PC;
+        hostLoop = fastEngineStep(singleInstruction);
+        bool finished = !pcInProgram(PC);
+        if (++steps % interval != 0 && !finished) {
+            continue;
+        }
+
+        // Let the reference interpreter catch up to the same point
+        uint64_t target = counters.instret;
+        swapMachineState(reference);
+        while (counters.instret < target && pcInProgram(PC)) {
+            retireInstruction();
+        }
+        swapMachineState(reference);
+
+        ++checks;
+        if (!compareMachineState(reference, print)) {
+            return false;
+        }
+        matchedSteps = steps;
+    }
+    return true;
+}
+
+void cosimProgram(int interval, bool singleInstruction) {
+    if (!copyLoopFastPathEnabled()) {
+        cout << "Note: breakpoints are set, so both engines interpret every instruction\n";
+    }
+    // Keep the starting state so a divergence can be replayed precisely
+    vector<uint8_t> initialMemory(memory, memory + memory_size);
+    int64_t initialRegisters[no_of_registers];
+    copy(begin(registers), end(registers), begin(initialRegisters));
+    int initialPC = PC;
+    Counters initialCounters = counters;
+
+    vector<uint8_t> referenceMemory(initialMemory);
+    MachineState reference;
+    auto restart = [&]() {
+        copy(begin(initialRegisters), end(initialRegisters), begin(registers));
+        copy(begin(initialRegisters), end(initialRegisters), begin(reference.registers));
+        PC = reference.PC = initialPC;
+        counters = reference.counters = initialCounters;
+        memcpy(memory, initialMemory.data(), memory_size);
+        memcpy(referenceMemory.data(), initialMemory.data(), memory_size);
+        reference.memory = referenceMemory.data();
+        dirtyPages.assign(memory_size / dirtyPageSize + 1, 0);
+    };
+    restart();
+
+    long matchedSteps = 0, checks = 0;
+    int failedPC;
+    bool hostLoop;
+    if (runLockstep(reference, interval, singleInstruction, false, matchedSteps, checks, failedPC, hostLoop)) {
+        cout << "Co-simulation passed: " << dec << counters.instret << " instructions, " << checks << " checks\n";
+        dirtyPages.clear();
+        return;
+    }
+
+    // Replay to the last check that matched, then compare after every
+    // instruction to pin down the one that diverged
+    restart();
+    for (long step = 0; step < matchedSteps; ++step) {
+        fastEngineStep(singleInstruction);
+    }
+    long replayedSteps = 0, replayChecks = 0;
+    if (runLockstep(reference, 1, true, true, replayedSteps, replayChecks, failedPC, hostLoop)) {
+        cout << "Divergence could not be reproduced instruction by instruction\n";
+    } else {
+        cout << "Divergence after " << dec << counters.instret << " instructions, in the "
+             << (hostLoop ? "host-executed loop" : "instruction") << " at PC = 0x" << hex << setw(8)
+             << setfill('0') << failedPC << " (" << describeInstruction(failedPC) << ")\n";
+    }
+    cout << dec;
+    dirtyPages.clear();
+}
+
+int main(int argc, char *argv[]) {
+    string statsFile;               // --stats <file>: write counters as JSON on exit
+    for (int i = 1; i < argc; ++i) {
+        if (string(argv[i]) == "--stats" && i + 1 < argc) {
+            statsFile = argv[++i];
+        }
+        else if (string(argv[i]) == "--cache-dir" && i + 1 < argc) {
+            programCacheDir = argv[++i];
+        }
+    }
     string command;
     while (true) {
-        getline(cin, command);
+        if (!getline(cin, command)) {
+            break;
+        }
         stringstream ss(command);
         string cmd, filename;
         ss >> cmd;
@@ -765,14 +2334,19 @@ int main() {
             ss >> hex >> addr >> dec >> count;
             printMemory(addr, count);
         }
+        else if (cmd == "dump") {
+            int addr, count;
+            ss >> hex >> addr >> dec >> count;
+            dumpMemory(addr, count);
+        }
         else if (cmd == "step") {
             stepProgram();
         }
         else if (cmd == "break") {
             int line;
             ss >> line;
-            if (line >= 0 && line < instructions.size()) {
-                breakpoints.push_back((line-1) * 4);  // Store the address as line * 4 (since each instruction is 4 bytes)
+            if (line >= 1 && line <= instructions.size()) {
+                breakpoints.push_back(instructionAddressOf(line - 1));  // Store the byte address of the instruction
                 cout << "Breakpoint set at line " << line << "\n";
             } else {
                 cout << "Error: Invalid line number.\n";
@@ -784,7 +2358,7 @@ int main() {
             if (subcmd == "break") {
                 int line;
                 ss >> line;
-                int pcValue = (line-1) * 4;
+                int pcValue = instructionAddressOf(line - 1);
                 auto it = find(breakpoints.begin(), breakpoints.end(), pcValue);
                 if (it != breakpoints.end()) {
                     breakpoints.erase(it);
@@ -794,6 +2368,33 @@ int main() {
                 }
             }
         }
+        else if (cmd == "gdbserver") {
+            string endpoint;
+            ss >> endpoint;
+            runGdbServer(endpoint.empty() ? "1234" : endpoint);
+        }
+        else if (cmd == "cosim") {
+            string mode;
+            int interval = 1;
+            ss >> mode;
+            bool singleInstruction = (mode == "insn");
+            if (singleInstruction) {
+                ss >> interval;
+            } else if (!mode.empty()) {
+                stringstream(mode) >> interval;
+            }
+            cosimProgram(max(interval, 1), singleInstruction);
+        }
+        else if (cmd == "stats") {
+            string file;
+            ss >> file;
+            if (file.empty()) {
+                printStats(cout);
+            } else {
+                ofstream out(file);
+                printStats(out);
+            }
+        }
         else if (cmd == "exit") {
             cout << "Exited the simulator\n";
             break;
@@ -804,5 +2405,9 @@ int main() {
         cout << "\n";
     }
 
+    if (!statsFile.empty()) {
+        ofstream out(statsFile);
+        printStats(out);
+    }
     return 0;
 }
\ No newline at end of file